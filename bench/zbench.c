@@ -0,0 +1,353 @@
+// zbench.c
+// Effective throughput of the DATA link over a shaped loopback connection,
+// plain vs compressed, using the proxy code in ../zlink.h.
+// Compile: cl /MD /O2 /W3 /Fe:zbench.exe bench\zbench.c Ws2_32.lib
+//     (or: cc -O2 -pthread -o zbench bench/zbench.c   on Linux/macOS)
+// Usage:   zbench [link_mbit] [megabytes]   (default 16 Mbit/s, 8 MB)
+//
+// generator -> [session A: plain -> link] -> shaper -> [session B: link -> plain] -> sink
+//
+// Sessions A and B are started with start_proxy_pair() exactly as client.c
+// and server.c do after the DATA handshake; the shaper relays A's link to B's
+// link at link_mbit. Throughput is payload bytes / time until the sink has
+// seen the last byte.
+
+#ifdef _WIN32
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+#define CPU_UNIT "cycles"
+
+#else
+
+/* Just enough of the Win32 API for zlink.h and this file */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+typedef int SOCKET;
+typedef long LONG;
+typedef unsigned long long ULONGLONG;
+typedef unsigned long long ULONG64;
+typedef void *HANDLE;
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define INVALID_SOCKET (-1)
+#define SD_BOTH SHUT_RDWR
+#define __stdcall
+#define closesocket close
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define sprintf_s snprintf
+#define InterlockedDecrement(p) __sync_sub_and_fetch((p), 1)
+#define InitializeCriticalSection(c) pthread_mutex_init((c), NULL)
+#define EnterCriticalSection pthread_mutex_lock
+#define LeaveCriticalSection pthread_mutex_unlock
+#define GetCurrentThread() NULL
+
+static ULONGLONG GetTickCount64(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000 + (ULONGLONG)ts.tv_nsec / 1000000;
+}
+
+static void Sleep(unsigned ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/* No portable per-thread cycle counter: report thread CPU time in ns instead */
+static int QueryThreadCycleTime(HANDLE h, ULONG64 *out) {
+    struct timespec ts;
+    (void)h;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    *out = (ULONG64)ts.tv_sec * 1000000000ULL + (ULONG64)ts.tv_nsec;
+    return 1;
+}
+
+typedef struct {
+    unsigned (*fn)(void *);
+    void *arg;
+} ThreadStart;
+
+static void *thread_trampoline(void *p) {
+    ThreadStart ts = *(ThreadStart *)p;
+    free(p);
+    ts.fn(ts.arg);
+    return NULL;
+}
+
+/* Threads stay joinable; the handle is a heap pthread_t (leaked if unused) */
+static uintptr_t _beginthreadex(void *sec, unsigned stack, unsigned (*fn)(void *), void *arg,
+                                unsigned flags, unsigned *id) {
+    pthread_t *t = (pthread_t *)malloc(sizeof(pthread_t));
+    ThreadStart *ts = (ThreadStart *)malloc(sizeof(ThreadStart));
+    (void)sec; (void)stack; (void)flags; (void)id;
+    if (!t || !ts) { free(t); free(ts); return 0; }
+    ts->fn = fn;
+    ts->arg = arg;
+    if (pthread_create(t, NULL, thread_trampoline, ts) != 0) { free(t); free(ts); return 0; }
+    return (uintptr_t)t;
+}
+
+#define INFINITE 0
+static void WaitForSingleObject(HANDLE h, unsigned ms) {
+    (void)ms;
+    pthread_join(*(pthread_t *)h, NULL);
+}
+
+static void CloseHandle(HANDLE h) {
+    free(h);
+}
+
+#define CPU_UNIT "ns"
+
+#endif
+
+#define BUF_SZ 4096
+#define SHAPE_CHUNK 4096
+
+#include "../zlink.h"
+
+static CRITICAL_SECTION stats_lock;
+static ZStats stats;
+static int verbose = 0;
+
+void debug_printf(const char *fmt, ...) {
+    if (!verbose) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+void add_stats(int port, const ZStats *d) {
+    (void)port;
+    EnterCriticalSection(&stats_lock);
+    zstats_add(&stats, d);
+    LeaveCriticalSection(&stats_lock);
+}
+
+static double now_sec(void) {
+#ifdef _WIN32
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return (double)t.QuadPart / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/* Connected loopback TCP pair: *a is the connecting end, *b the accepted end */
+static int tcp_pair(SOCKET *a, SOCKET *b) {
+    struct sockaddr_in sa;
+    int len = (int)sizeof(sa);
+    SOCKET l = socket(AF_INET, SOCK_STREAM, 0);
+    if (l == INVALID_SOCKET) return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+    if (bind(l, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(l, 1) != 0 ||
+        getsockname(l, (struct sockaddr *)&sa, (void *)&len) != 0) {
+        closesocket(l);
+        return 0;
+    }
+    *a = socket(AF_INET, SOCK_STREAM, 0);
+    if (*a == INVALID_SOCKET || connect(*a, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        closesocket(l);
+        return 0;
+    }
+    *b = accept(l, NULL, NULL);
+    closesocket(l);
+    return *b != INVALID_SOCKET;
+}
+
+typedef struct {
+    SOCKET from;
+    SOCKET to;
+    double bytes_per_sec;
+} Shaper;
+
+/* Relay from->to, pacing writes so the average rate is bytes_per_sec */
+static unsigned __stdcall shaper_thread(void *arg) {
+    Shaper *sh = (Shaper *)arg;
+    unsigned char buf[SHAPE_CHUNK];
+    double start = now_sec();
+    double sent = 0;
+    while (1) {
+        int r = recv(sh->from, (char *)buf, (int)sizeof(buf), 0);
+        if (r <= 0) break;
+        if (!send_all(sh->to, buf, r)) break;
+        sent += r;
+        double ahead = start + sent / sh->bytes_per_sec - now_sec();
+        if (ahead > 0.001) Sleep((unsigned)(ahead * 1000));
+    }
+    shutdown(sh->to, SD_BOTH);
+    shutdown(sh->from, SD_BOTH);
+    closesocket(sh->to);
+    closesocket(sh->from);
+    free(sh);
+    return 0;
+}
+
+typedef struct {
+    SOCKET s;
+    const unsigned char *data;
+    int len;
+} Writer;
+
+static unsigned __stdcall writer_thread(void *arg) {
+    Writer *w = (Writer *)arg;
+    send_all(w->s, w->data, w->len);
+    shutdown(w->s, SD_BOTH);
+    closesocket(w->s);
+    free(w);
+    return 0;
+}
+
+/* Newline-delimited JSON, like API responses or structured logs */
+static int fill_json(unsigned char *buf, int len) {
+    int pos = 0;
+    while (len - pos > 200) {
+        pos += sprintf_s((char *)buf + pos, (size_t)(len - pos),
+            "{\"ts\":%d,\"level\":\"%s\",\"user\":\"user%03d\",\"path\":\"/api/v1/items/%d\",\"status\":%d,\"ms\":%d}\n",
+            1700000000 + rand() % 100000, rand() % 4 ? "info" : "warn", rand() % 500,
+            rand() % 10000, rand() % 10 ? 200 : 404, rand() % 900);
+    }
+    return pos;
+}
+
+/* Incompressible bytes, standing in for TLS or media */
+static int fill_random(unsigned char *buf, int len) {
+    for (int i = 0; i < len; ++i) buf[i] = (unsigned char)(rand() >> 3);
+    return len;
+}
+
+/* JSON with incompressible stretches, to exercise auto off / back on */
+static int fill_mixed(unsigned char *buf, int len) {
+    int pos = 0, block = 1 << 20;
+    for (int i = 0; pos < len; ++i) {
+        int n = len - pos < block ? len - pos : block;
+        int got = (i % 2) ? fill_random(buf + pos, n) : fill_json(buf + pos, n);
+        if (got == 0) break;
+        pos += got;
+    }
+    return pos;
+}
+
+static int run(const char *name, const unsigned char *data, int len, int compress, double bytes_per_sec) {
+    SOCKET gen_w, gen_r, a_link, sh_in, sh_out, b_link, sink_w, sink_r;
+    if (!tcp_pair(&gen_w, &gen_r) || !tcp_pair(&a_link, &sh_in) ||
+        !tcp_pair(&sh_out, &b_link) || !tcp_pair(&sink_w, &sink_r)) {
+        printf("failed to set up loopback sockets\n");
+        return 0;
+    }
+    ZeroMemory(&stats, sizeof(stats));
+
+    /* owned and freed by their threads */
+    Shaper *sh = (Shaper *)malloc(sizeof(Shaper));
+    Writer *w = (Writer *)malloc(sizeof(Writer));
+    if (!sh || !w) { printf("out of memory\n"); return 0; }
+    sh->from = sh_in; sh->to = sh_out; sh->bytes_per_sec = bytes_per_sec;
+    w->s = gen_w; w->data = data; w->len = len;
+
+    double t0 = now_sec();
+    start_proxy_pair(gen_r, a_link, compress, 1, 0);
+    start_proxy_pair(sink_w, b_link, compress, 2, 0);
+    HANDLE th[2];
+    th[0] = (HANDLE)_beginthreadex(NULL, 0, shaper_thread, sh, 0, NULL);
+    th[1] = (HANDLE)_beginthreadex(NULL, 0, writer_thread, w, 0, NULL);
+
+    unsigned char *got = (unsigned char *)malloc((size_t)len);
+    int pos = 0;
+    while (got && pos < len) {
+        int r = recv(sink_r, (char *)got + pos, len - pos, 0);
+        if (r <= 0) break;
+        pos += r;
+    }
+    double secs = now_sec() - t0;
+    int ok = got && pos == len && memcmp(got, data, (size_t)len) == 0;
+    free(got);
+    closesocket(sink_r);
+    for (int i = 0; i < 2; ++i) {
+        if (!th[i]) continue;
+        WaitForSingleObject(th[i], INFINITE);
+        CloseHandle(th[i]);
+    }
+    Sleep(100);  // let the proxy threads flush their counters
+
+    EnterCriticalSection(&stats_lock);
+    ZStats z = stats;
+    LeaveCriticalSection(&stats_lock);
+    printf("%-7s %-6s %8.2f MB/s", name, compress ? "lz4" : "plain", (double)len / secs / 1e6);
+    if (compress) {
+        printf("   ratio %5.2fx   tx %6.2f %s/B   rx %6.2f %s/B   turned off %llu",
+               z.tx_wire ? (double)z.tx_raw / (double)z.tx_wire : 0.0,
+               z.tx_raw ? (double)z.tx_cycles / (double)z.tx_raw : 0.0, CPU_UNIT,
+               z.rx_raw ? (double)z.rx_cycles / (double)z.rx_raw : 0.0, CPU_UNIT,
+               z.turned_off);
+    }
+    printf("%s\n", ok ? "" : "   DATA MISMATCH");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    double mbit = argc > 1 ? atof(argv[1]) : 16.0;
+    int mb = argc > 2 ? atoi(argv[2]) : 8;
+    if (argc > 3 && strcmp(argv[3], "-v") == 0) verbose = 1;
+    if (mbit <= 0 || mb <= 0) {
+        printf("Usage: %s [link_mbit] [megabytes] [-v]\n", argv[0]);
+        return 1;
+    }
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) { printf("WSAStartup failed\n"); return 1; }
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    InitializeCriticalSection(&stats_lock);
+
+    int len = mb * 1000 * 1000;
+    unsigned char *data = (unsigned char *)malloc((size_t)len);
+    if (!data) { printf("out of memory\n"); return 1; }
+    double bps = mbit * 1e6 / 8.0;
+    printf("link %.1f Mbit/s, %d MB per run, cpu cost in %s per payload byte\n", mbit, mb, CPU_UNIT);
+
+    int ok = 1;
+    struct { const char *name; int (*fill)(unsigned char *, int); } sets[] = {
+        { "json", fill_json }, { "random", fill_random }, { "mixed", fill_mixed },
+    };
+    for (int i = 0; i < (int)(sizeof(sets) / sizeof(sets[0])); ++i) {
+        srand(7);
+        int n = sets[i].fill(data, len);
+        ok &= run(sets[i].name, data, n, 0, bps);
+        ok &= run(sets[i].name, data, n, 1, bps);
+    }
+    free(data);
+    return ok ? 0 : 1;
+}
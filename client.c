@@ -20,10 +20,14 @@
 #define _countof(a) (sizeof(a)/sizeof((a)[0]))
 #endif
 
+#include "zlink.h"
+
 typedef struct {
     int server_port;           // port on server to listen on
     char client_addr[64];      // address on client machine to connect to
     int client_port;           // port on client machine to connect to
+    int compress;              // frame + compress DATA connections of this tunnel
+    ZStats stats;              // compression counters for this tunnel
 } TunnelMapping;
 
 static TunnelMapping mappings[MAX_TUNNELS];
@@ -72,7 +76,7 @@ int recv_line(SOCKET s, char *buf, int buflen) {
     return pos;
 }
 
-void add_mapping(int server_port, const char *client_addr, int client_port) {
+void add_mapping(int server_port, const char *client_addr, int client_port, int compress) {
     EnterCriticalSection(&map_lock);
     if (mapping_count >= MAX_TUNNELS) {
         LeaveCriticalSection(&map_lock);
@@ -82,6 +86,8 @@ void add_mapping(int server_port, const char *client_addr, int client_port) {
     mappings[mapping_count].server_port = server_port;
     strncpy_s(mappings[mapping_count].client_addr, sizeof(mappings[mapping_count].client_addr), client_addr, _TRUNCATE);
     mappings[mapping_count].client_port = client_port;
+    mappings[mapping_count].compress = compress;
+    ZeroMemory(&mappings[mapping_count].stats, sizeof(ZStats));
     mapping_count++;
     LeaveCriticalSection(&map_lock);
 }
@@ -99,12 +105,13 @@ void remove_mapping(int server_port) {
     LeaveCriticalSection(&map_lock);
 }
 
-int find_mapping(int server_port, char *out_addr, int *out_port) {
+int find_mapping(int server_port, char *out_addr, int *out_port, int *out_compress) {
     EnterCriticalSection(&map_lock);
     for (int i = 0; i < mapping_count; ++i) {
         if (mappings[i].server_port == server_port) {
             strncpy_s(out_addr, 64, mappings[i].client_addr, _TRUNCATE);
             *out_port = mappings[i].client_port;
+            *out_compress = mappings[i].compress;
             LeaveCriticalSection(&map_lock);
             return 1;
         }
@@ -113,44 +120,23 @@ int find_mapping(int server_port, char *out_addr, int *out_port) {
     return 0;
 }
 
-/* proxy worker */
-unsigned __stdcall proxy_worker(void *arg) {
-    SOCKET *socks = (SOCKET*)arg;
-    SOCKET a = socks[0], b = socks[1];
-    free(socks);
-    char buf[BUF_SZ];
-    while (1) {
-        int r = recv(a, buf, (int)sizeof(buf), 0);
-        if (r <= 0) break;
-        int sent = 0;
-        while (sent < r) {
-            int w = send(b, buf + sent, r - sent, 0);
-            if (w <= 0) goto done;
-            sent += w;
+/* Accumulate compression counters into the mapping for server_port */
+void add_stats(int server_port, const ZStats *d) {
+    EnterCriticalSection(&map_lock);
+    for (int i = 0; i < mapping_count; ++i) {
+        if (mappings[i].server_port == server_port) {
+            zstats_add(&mappings[i].stats, d);
+            break;
         }
     }
-done:
-    shutdown(a, SD_BOTH);
-    shutdown(b, SD_BOTH);
-    closesocket(a);
-    closesocket(b);
-    return 0;
-}
-
-void start_proxy_pair(SOCKET a, SOCKET b) {
-    SOCKET *p1 = (SOCKET*)malloc(sizeof(SOCKET) * 2);
-    p1[0] = a; p1[1] = b;
-    SOCKET *p2 = (SOCKET*)malloc(sizeof(SOCKET) * 2);
-    p2[0] = b; p2[1] = a;
-    _beginthreadex(NULL, 0, proxy_worker, p1, 0, NULL);
-    _beginthreadex(NULL, 0, proxy_worker, p2, 0, NULL);
+    LeaveCriticalSection(&map_lock);
 }
 
 /* Called when server sends "OPEN <sid> <server_port>" */
 void handle_open(int sessionid, int server_port) {
     debug_printf("OPEN %d (server_port=%d) received", sessionid, server_port);
-    char target_addr[64] = {0}; int target_port = 0;
-    if (!find_mapping(server_port, target_addr, &target_port)) {
+    char target_addr[64] = {0}; int target_port = 0, compress = 0;
+    if (!find_mapping(server_port, target_addr, &target_port, &compress)) {
         debug_printf("No mapping for server_port %d, ignoring", server_port);
         return;
     }
@@ -162,7 +148,7 @@ void handle_open(int sessionid, int server_port) {
         return;
     }
     char line[64];
-    sprintf_s(line, sizeof(line), "DATA %d\n", sessionid);
+    sprintf_s(line, sizeof(line), compress ? "DATA %d Z\n" : "DATA %d\n", sessionid);
     send(data_sock, line, (int)strlen(line), 0);
 
     /* Connect to client-side target */
@@ -192,8 +178,22 @@ void handle_open(int sessionid, int server_port) {
         return;
     }
 
-    debug_printf("Paired DATA %d <-> %s:%d", sessionid, target_addr, target_port);
-    start_proxy_pair(data_sock, local_sock);
+    if (compress) {
+        int acked = zlink_wait_ack(data_sock, ZLINK_ACK_TIMEOUT_MS);
+        if (acked < 0) {
+            debug_printf("DATA %d closed before the server answered", sessionid);
+            closesocket(data_sock);
+            closesocket(local_sock);
+            return;
+        }
+        if (!acked) {
+            debug_printf("Server did not acknowledge compression for DATA %d, using plain mode", sessionid);
+            compress = 0;
+        }
+    }
+
+    debug_printf("Paired DATA %d <-> %s:%d%s", sessionid, target_addr, target_port, compress ? " (compressed)" : "");
+    start_proxy_pair(local_sock, data_sock, compress, sessionid, server_port);
 }
 
 /* Control reader thread: receives server messages like OPEN ... */
@@ -246,7 +246,7 @@ int main(int argc, char **argv) {
 
     /* interactive input */
     char cmdline[256];
-    printf("Commands:\n  add <server_port> <client_addr> <client_port>\n  remove <server_port>\n  list\n  exit\n");
+    printf("Commands:\n  add <server_port> <client_addr> <client_port> [compress]\n  remove <server_port>\n  list\n  exit\n");
     while (1) {
         printf("> ");
         if (!fgets(cmdline, (int)sizeof(cmdline), stdin)) break;
@@ -256,16 +256,20 @@ int main(int argc, char **argv) {
 
         if (strncmp(cmdline, "add ", 4) == 0) {
             int srvp = 0, clp = 0;
-            char claddr[64] = {0};
-            if (sscanf_s(cmdline + 4, "%d %63s %d", &srvp, claddr, (unsigned)_countof(claddr), &clp) >= 3) {
+            char claddr[64] = {0}, opt[sizeof(cmdline)] = {0}, extra = 0;
+            int n = sscanf_s(cmdline + 4, "%d %63s %d %255s %c", &srvp, claddr, (unsigned)_countof(claddr), &clp,
+                             opt, (unsigned)_countof(opt), &extra, 1);
+            /* only "compress" is accepted after the port, so a typo doesn't silently give a plain tunnel */
+            if (n == 3 || (n == 4 && strcmp(opt, "compress") == 0)) {
+                int compress = n == 4;
                 char out[256];
                 /* server only needs LISTEN <port>; we include client addr/port in the line for human readability */
                 sprintf_s(out, sizeof(out), "LISTEN %d %s %d\n", srvp, claddr, clp);
                 send(ctrl_sock, out, (int)strlen(out), 0);
-                add_mapping(srvp, claddr, clp);
-                debug_printf("Requested LISTEN %d -> %s:%d", srvp, claddr, clp);
+                add_mapping(srvp, claddr, clp, compress);
+                debug_printf("Requested LISTEN %d -> %s:%d%s", srvp, claddr, clp, compress ? " (compressed)" : "");
             } else {
-                printf("Usage: add <server_port> <client_addr> <client_port>\n");
+                printf("Usage: add <server_port> <client_addr> <client_port> [compress]\n");
             }
         } else if (strncmp(cmdline, "remove ", 7) == 0) {
             int srvp = 0;
@@ -279,16 +283,26 @@ int main(int argc, char **argv) {
                 printf("Usage: remove <server_port>\n");
             }
         } else if (strcmp(cmdline, "list") == 0) {
+            /* snapshot under the lock, print without it so a slow console can't stall the proxies */
+            static TunnelMapping snap[MAX_TUNNELS];
             EnterCriticalSection(&map_lock);
-            if (mapping_count == 0) printf("No mappings\n");
-            for (int i = 0; i < mapping_count; ++i) {
-                printf("server:%d -> %s:%d\n", mappings[i].server_port, mappings[i].client_addr, mappings[i].client_port);
-            }
+            int n = mapping_count;
+            memcpy(snap, mappings, sizeof(TunnelMapping) * n);
             LeaveCriticalSection(&map_lock);
+            if (n == 0) printf("No mappings\n");
+            for (int i = 0; i < n; ++i) {
+                printf("server:%d -> %s:%d%s\n", snap[i].server_port, snap[i].client_addr, snap[i].client_port,
+                       snap[i].compress ? " [compress]" : "");
+                if (snap[i].compress) {
+                    char zs[320];
+                    format_zstats(zs, sizeof(zs), &snap[i].stats);
+                    printf("    %s\n", zs);
+                }
+            }
         } else if (strcmp(cmdline, "exit") == 0) {
             break;
         } else {
-            printf("Unknown. Commands:\n  add <server_port> <client_addr> <client_port>\n  remove <server_port>\n  list\n  exit\n");
+            printf("Unknown. Commands:\n  add <server_port> <client_addr> <client_port> [compress]\n  remove <server_port>\n  list\n  exit\n");
         }
     }
 
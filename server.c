@@ -18,6 +18,8 @@
 #define BUF_SZ 4096
 #define MAX_TUNNELS 64
 
+#include "zlink.h"
+
 typedef struct Pending {
     int sessionid;
     SOCKET ext_sock;
@@ -29,6 +31,7 @@ typedef struct {
     int port;
     SOCKET listener;
     HANDLE thread;
+    ZStats stats;   // compression counters of compressed sessions on this port
 } Tunnel;
 
 typedef struct {
@@ -66,13 +69,14 @@ void add_pending(ServerState *st, int sid, SOCKET ext, int port) {
     LeaveCriticalSection(&st->lock);
 }
 
-SOCKET pop_pending(ServerState *st, int sid) {
+SOCKET pop_pending(ServerState *st, int sid, int *out_port) {
     EnterCriticalSection(&st->lock);
     Pending **pp = &st->pending;
     while (*pp) {
         if ((*pp)->sessionid == sid) {
             Pending *found = *pp;
             SOCKET s = found->ext_sock;
+            *out_port = found->port;
             *pp = found->next;
             free(found);
             LeaveCriticalSection(&st->lock);
@@ -133,6 +137,7 @@ void start_tunnel(ServerState *st, int port) {
     Tunnel *t = &st->tunnels[st->tunnel_count++];
     t->port = port;
     t->listener = l;
+    ZeroMemory(&t->stats, sizeof(ZStats));
     t->thread = (HANDLE)_beginthreadex(NULL, 0, tunnel_accept_thread, (void*)t, 0, NULL);
     LeaveCriticalSection(&st->lock);
     debug_printf("Started tunnel on server port %d", port);
@@ -146,10 +151,16 @@ void stop_tunnel(ServerState *st, int port) {
             closesocket(st->tunnels[i].listener);
             WaitForSingleObject(st->tunnels[i].thread, 500);
             CloseHandle(st->tunnels[i].thread);
+            ZStats z = st->tunnels[i].stats;
             st->tunnels[i] = st->tunnels[st->tunnel_count - 1];
             st->tunnel_count--;
             LeaveCriticalSection(&st->lock);
             debug_printf("Stopped tunnel on port %d", port);
+            if (z.tx_raw || z.rx_raw) {
+                char zs[320];
+                format_zstats(zs, sizeof(zs), &z);
+                debug_printf("Tunnel %d compression: %s", port, zs);
+            }
             return;
         }
     }
@@ -190,39 +201,17 @@ unsigned __stdcall tunnel_accept_thread(void *arg) {
     return 0;
 }
 
-/* Proxy worker copies a->b until EOF */
-unsigned __stdcall proxy_worker(void *arg) {
-    SOCKET *s = (SOCKET*)arg;
-    SOCKET a = s[0];
-    SOCKET b = s[1];
-    free(s);
-    char buf[BUF_SZ];
-    while (1) {
-        int r = recv(a, buf, (int)sizeof(buf), 0);
-        if (r <= 0) break;
-        int sent = 0;
-        while (sent < r) {
-            int w = send(b, buf + sent, r - sent, 0);
-            if (w <= 0) goto done;
-            sent += w;
+/* Accumulate compression counters into the tunnel on port */
+void add_stats(int port, const ZStats *d) {
+    ServerState *st = g_state;
+    EnterCriticalSection(&st->lock);
+    for (int i = 0; i < st->tunnel_count; ++i) {
+        if (st->tunnels[i].port == port) {
+            zstats_add(&st->tunnels[i].stats, d);
+            break;
         }
     }
-done:
-    shutdown(a, SD_BOTH);
-    shutdown(b, SD_BOTH);
-    closesocket(a);
-    closesocket(b);
-    return 0;
-}
-
-/* Start bidirectional proxy pair using two threads */
-void start_proxy_pair(SOCKET a, SOCKET b) {
-    SOCKET *p1 = (SOCKET*)malloc(sizeof(SOCKET) * 2);
-    p1[0] = a; p1[1] = b;
-    SOCKET *p2 = (SOCKET*)malloc(sizeof(SOCKET) * 2);
-    p2[0] = b; p2[1] = a;
-    _beginthreadex(NULL, 0, proxy_worker, p1, 0, NULL);
-    _beginthreadex(NULL, 0, proxy_worker, p2, 0, NULL);
+    LeaveCriticalSection(&st->lock);
 }
 
 /* Read a single line (blocking) until '\n' */
@@ -324,15 +313,24 @@ int main(int argc, char **argv) {
         while (r > 0 && (line[r-1] == '\n' || line[r-1] == '\r')) { line[r-1] = 0; r--; }
 
         if (strncmp(line, "DATA ", 5) == 0) {
+            /* "DATA <sid> Z" asks for a framed, compressed link */
             int sid = atoi(line + 5);
-            SOCKET ext = pop_pending(&st, sid);
+            const char *opt = strchr(line + 5, ' ');
+            int compress = opt && opt[1] == 'Z';
+            int ext_port = 0;
+            SOCKET ext = pop_pending(&st, sid, &ext_port);
             if (ext == INVALID_SOCKET) {
                 debug_printf("No pending for DATA %d", sid);
                 closesocket(s);
                 continue;
             }
-            debug_printf("Pairing DATA %d with external socket", sid);
-            start_proxy_pair(ext, s);
+            if (compress && !send_all(s, (const unsigned char*)ZLINK_ACK, (int)(sizeof(ZLINK_ACK) - 1))) {
+                closesocket(s);
+                closesocket(ext);
+                continue;
+            }
+            debug_printf("Pairing DATA %d with external socket%s", sid, compress ? " (compressed)" : "");
+            start_proxy_pair(ext, s, compress, sid, ext_port);
         } else {
             /* treat as control socket */
             EnterCriticalSection(&st.lock);
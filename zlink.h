@@ -0,0 +1,390 @@
+// zlink.h
+// DATA link framing, compression and proxying shared by client.c and server.c.
+// Both ends must agree on this byte for byte, so keep it in this one place.
+
+#ifndef ZLINK_H
+#define ZLINK_H
+
+/* A compressed DATA connection carries frames instead of a raw byte stream:
+     <raw_len:u16 be> <comp_len:u16 be> <payload>
+   comp_len == 0 means the payload is raw_len uncompressed bytes, otherwise it
+   is comp_len bytes of LZ4 block format that expand to raw_len bytes.
+   The client asks for framing with "DATA <sid> Z"; the server agrees by
+   writing ZLINK_ACK on the DATA socket before anything else. A server that
+   doesn't know about compression never sends it, and the client then keeps
+   the connection plain.
+   The sending side gives up on compression for a session once chunks stop
+   shrinking (TLS, media, archives) and only re-probes occasionally. */
+
+#define ZLINK_ACK "ZLINK\n"
+#define ZLINK_ACK_TIMEOUT_MS 3000
+#define ZBUF_SZ 16384
+#define Z_MIN_CHUNK 64         // smaller chunks are always sent raw
+#define Z_MAX_MISSES 8         // consecutive non-shrinking chunks before turning off
+#define Z_PROBE_INTERVAL 64    // while off, retry compression every N chunks
+#define Z_FLUSH_CHUNKS 64      // fold session counters into the tunnel every N chunks
+#define Z_FLUSH_MS 1000        // ... or at least this often
+#define LZ_HASH_BITS 12
+
+typedef struct {
+    unsigned long long tx_raw;     // bytes read from the plain side
+    unsigned long long tx_wire;    // bytes written to the link (incl. frame headers)
+    unsigned long long tx_cycles;  // CPU cycles this thread spent compressing
+    unsigned long long rx_wire;    // bytes read from the link
+    unsigned long long rx_raw;     // bytes written to the plain side
+    unsigned long long rx_cycles;  // CPU cycles this thread spent decompressing
+    unsigned long long turned_off; // times a session switched compression off
+} ZStats;
+
+static unsigned lz_hash(const unsigned char *p) {
+    unsigned v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *lz_put_len(unsigned char *op, int len) {
+    while (len >= 255) { *op++ = 255; len -= 255; }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Compress src[0..n) (n <= 65535) into dst as an LZ4 block.
+   Returns the compressed size, or 0 if it does not fit in cap bytes. */
+static int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    unsigned short table[1 << LZ_HASH_BITS];
+    const unsigned char *ip = src, *anchor = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    memset(table, 0, sizeof(table));
+    if (n >= 13) {
+        const unsigned char *mflimit = iend - 12, *matchlimit = iend - 5;
+        ip++;
+        while (ip < mflimit) {
+            unsigned h = lz_hash(ip);
+            const unsigned char *ref = src + table[h];
+            table[h] = (unsigned short)(ip - src);
+            if (memcmp(ref, ip, 4) != 0) {
+                ip += 1 + ((ip - anchor) >> 6);  // skip faster through data that doesn't match
+                /* pending literals alone no longer fit: give up instead of scanning on */
+                if (ip - anchor + (ip - anchor) / 255 + 2 > oend - op) return 0;
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) { ip--; ref--; }
+            const unsigned char *mp = ip + 4, *rp = ref + 4;
+            while (mp < matchlimit && *mp == *rp) { mp++; rp++; }
+            int lit = (int)(ip - anchor);
+            int mlen = (int)(mp - ip) - 4;
+            if (oend - op < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+            unsigned char *token = op++;
+            *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) op = lz_put_len(op, lit - 15);
+            memcpy(op, anchor, lit); op += lit;
+            unsigned off = (unsigned)(ip - ref);
+            *op++ = (unsigned char)off;
+            *op++ = (unsigned char)(off >> 8);
+            *token |= (unsigned char)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) op = lz_put_len(op, mlen - 15);
+            ip = anchor = mp;
+        }
+    }
+    int lit = (int)(iend - anchor);
+    if (oend - op < 1 + lit / 255 + 1 + lit) return 0;
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit); op += lit;
+    return (int)(op - dst);
+}
+
+/* Decompress an LZ4 block. Returns the output size, or -1 on malformed input. */
+static int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        int lit = (int)(token >> 4);
+        if (lit == 15) {
+            unsigned char b;
+            do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op) return -1;
+        memcpy(op, ip, lit); op += lit; ip += lit;
+        if (ip >= iend) break;  // last sequence has no match part
+        if (iend - ip < 2) return -1;
+        int off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > op - dst) return -1;
+        int mlen = (int)(token & 15);
+        if (mlen == 15) {
+            unsigned char b;
+            do { if (ip >= iend) return -1; b = *ip++; mlen += b; } while (b == 255);
+        }
+        mlen += 4;
+        if (mlen > oend - op) return -1;
+        const unsigned char *ref = op - off;
+        if (off >= mlen) { memcpy(op, ref, mlen); op += mlen; }
+        else { while (mlen--) *op++ = *ref++; }  // overlapping copy
+    }
+    return (int)(op - dst);
+}
+
+/* CPU cycles charged to the calling thread so far; unlike a wall clock this
+   doesn't count time the thread was preempted or waiting */
+static ULONG64 thread_cycles(void) {
+    ULONG64 c = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &c);
+    return c;
+}
+
+/* Format tx/rx ratio and CPU cost for display */
+static void format_zstats(char *out, size_t outlen, const ZStats *z) {
+    double tx_ratio = z->tx_wire ? (double)z->tx_raw / (double)z->tx_wire : 0.0;
+    double rx_ratio = z->rx_wire ? (double)z->rx_raw / (double)z->rx_wire : 0.0;
+    sprintf_s(out, outlen,
+        "tx %llu -> %llu bytes (%.2fx, %.2f Mcycles cpu), rx %llu -> %llu bytes (%.2fx, %.2f Mcycles cpu), turned off %llu times",
+        z->tx_raw, z->tx_wire, tx_ratio, (double)z->tx_cycles / 1e6,
+        z->rx_wire, z->rx_raw, rx_ratio, (double)z->rx_cycles / 1e6,
+        z->turned_off);
+}
+
+static void zstats_add(ZStats *dst, const ZStats *d) {
+    dst->tx_raw += d->tx_raw;
+    dst->tx_wire += d->tx_wire;
+    dst->tx_cycles += d->tx_cycles;
+    dst->rx_wire += d->rx_wire;
+    dst->rx_raw += d->rx_raw;
+    dst->rx_cycles += d->rx_cycles;
+    dst->turned_off += d->turned_off;
+}
+
+/* Provided by the including file */
+void debug_printf(const char *fmt, ...);
+/* Fold d into the counters of the tunnel on server port `port` */
+void add_stats(int port, const ZStats *d);
+
+/* Send/receive exactly len bytes; return 1 on success, 0 on error/EOF */
+static int send_all(SOCKET s, const unsigned char *buf, int len) {
+    int sent = 0;
+    while (sent < len) {
+        int w = send(s, (const char*)buf + sent, len - sent, 0);
+        if (w <= 0) return 0;
+        sent += w;
+    }
+    return 1;
+}
+
+static int recv_all(SOCKET s, unsigned char *buf, int len) {
+    int got = 0;
+    while (got < len) {
+        int r = recv(s, (char*)buf + got, len - got, 0);
+        if (r <= 0) return 0;
+        got += r;
+    }
+    return 1;
+}
+
+/* Client side: wait for ZLINK_ACK after sending "DATA <sid> Z".
+   Returns 1 if the server agreed to framing (ack consumed), 0 if not (nothing
+   consumed: whatever arrived is plain payload from an older server, or
+   nothing arrived before the timeout), -1 if the connection failed. */
+static int zlink_wait_ack(SOCKET s, int timeout_ms) {
+    const int ack_len = (int)(sizeof(ZLINK_ACK) - 1);
+    ULONGLONG deadline = GetTickCount64() + (ULONGLONG)timeout_ms;
+    while (1) {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline) return 0;
+        ULONGLONG left = deadline - now;
+        fd_set rd;
+        FD_ZERO(&rd);
+        FD_SET(s, &rd);
+        struct timeval tv;
+        tv.tv_sec = (long)(left / 1000);
+        tv.tv_usec = (long)(left % 1000) * 1000;
+        int sel = select((int)s + 1, &rd, NULL, NULL, &tv);
+        if (sel < 0) return -1;
+        if (sel == 0) return 0;
+        char peek[sizeof(ZLINK_ACK)];
+        int r = recv(s, peek, ack_len, MSG_PEEK);
+        if (r <= 0) return -1;
+        if (memcmp(peek, ZLINK_ACK, r) != 0) return 0;
+        if (r == ack_len) return recv_all(s, (unsigned char*)peek, ack_len) ? 1 : -1;
+        Sleep(1);  // partial ack, wait for the rest
+    }
+}
+
+/* One proxied connection: the plain socket (external peer or client-side
+   target) paired with its DATA link. Owned by its two proxy threads; the
+   last one out closes the sockets and frees it. */
+typedef struct {
+    SOCKET plain;
+    SOCKET link;
+    int compress;
+    int sessionid;
+    int port;               // server port of the tunnel, used for stats
+    volatile LONG workers;  // proxy threads still running
+    ZStats dir[2];          // [0] plain -> link, [1] link -> plain; each written by its own thread only
+} ZSession;
+
+typedef struct {
+    ZSession *sess;
+    int dir;
+} ProxyArgs;
+
+/* Counters not yet folded into the tunnel, so the data path only takes the
+   tunnel lock every Z_FLUSH_CHUNKS chunks / Z_FLUSH_MS ms */
+typedef struct {
+    ZStats pending;
+    int chunks;
+    ULONGLONG last;
+} ZFlush;
+
+static void zflush_now(ZSession *s, ZFlush *f) {
+    if (f->chunks) add_stats(s->port, &f->pending);
+    ZeroMemory(&f->pending, sizeof(f->pending));
+    f->chunks = 0;
+    f->last = GetTickCount64();
+}
+
+static void zflush_count(ZSession *s, ZStats *total, ZFlush *f, const ZStats *d) {
+    zstats_add(total, d);
+    zstats_add(&f->pending, d);
+    if (++f->chunks >= Z_FLUSH_CHUNKS || GetTickCount64() - f->last >= Z_FLUSH_MS) zflush_now(s, f);
+}
+
+/* Read plain bytes and write frames to the link */
+static void compress_loop(ZSession *s) {
+    unsigned char raw[ZBUF_SZ];
+    unsigned char frame[4 + ZBUF_SZ];
+    int enabled = 1, misses = 0, idle = 0;
+    ZFlush f;
+    ZeroMemory(&f, sizeof(f));
+    f.last = GetTickCount64();
+    while (1) {
+        int r = recv(s->plain, (char*)raw, (int)sizeof(raw), 0);
+        if (r <= 0) break;
+        ZStats d;
+        ZeroMemory(&d, sizeof(d));
+        int clen = 0;
+        if (r >= Z_MIN_CHUNK && (enabled || ++idle >= Z_PROBE_INTERVAL)) {
+            ULONG64 c0 = thread_cycles();
+            /* cap the output so only chunks that shrink by at least 1/8 are kept */
+            clen = lz_compress(raw, r, frame + 4, r - r / 8);
+            d.tx_cycles = (unsigned long long)(thread_cycles() - c0);
+            idle = 0;
+            if (clen > 0) {
+                if (!enabled) debug_printf("Session %d: compression back on", s->sessionid);
+                enabled = 1;
+                misses = 0;
+            } else if (enabled && ++misses >= Z_MAX_MISSES) {
+                enabled = 0;
+                d.turned_off = 1;
+                debug_printf("Session %d: stream not compressible, compression off", s->sessionid);
+            }
+        }
+        if (clen == 0) memcpy(frame + 4, raw, r);
+        frame[0] = (unsigned char)(r >> 8);
+        frame[1] = (unsigned char)r;
+        frame[2] = (unsigned char)(clen >> 8);
+        frame[3] = (unsigned char)clen;
+        int flen = 4 + (clen ? clen : r);
+        if (!send_all(s->link, frame, flen)) break;
+        d.tx_raw = (unsigned long long)r;
+        d.tx_wire = (unsigned long long)flen;
+        zflush_count(s, &s->dir[0], &f, &d);
+    }
+    zflush_now(s, &f);
+}
+
+/* Read frames from the link and write plain bytes */
+static void decompress_loop(ZSession *s) {
+    unsigned char hdr[4];
+    unsigned char payload[ZBUF_SZ];
+    unsigned char raw[ZBUF_SZ];
+    ZFlush f;
+    ZeroMemory(&f, sizeof(f));
+    f.last = GetTickCount64();
+    while (1) {
+        if (!recv_all(s->link, hdr, 4)) break;
+        int raw_len = (hdr[0] << 8) | hdr[1];
+        int comp_len = (hdr[2] << 8) | hdr[3];
+        int plen = comp_len ? comp_len : raw_len;
+        if (raw_len == 0 || raw_len > ZBUF_SZ || plen > ZBUF_SZ) {
+            debug_printf("Session %d: bad frame header", s->sessionid);
+            break;
+        }
+        if (!recv_all(s->link, payload, plen)) break;
+        ZStats d;
+        ZeroMemory(&d, sizeof(d));
+        const unsigned char *out = payload;
+        if (comp_len) {
+            ULONG64 c0 = thread_cycles();
+            int n = lz_decompress(payload, comp_len, raw, raw_len);
+            d.rx_cycles = (unsigned long long)(thread_cycles() - c0);
+            if (n != raw_len) {
+                debug_printf("Session %d: corrupt compressed frame", s->sessionid);
+                break;
+            }
+            out = raw;
+        }
+        if (!send_all(s->plain, out, raw_len)) break;
+        d.rx_wire = (unsigned long long)(4 + plen);
+        d.rx_raw = (unsigned long long)raw_len;
+        zflush_count(s, &s->dir[1], &f, &d);
+    }
+    zflush_now(s, &f);
+}
+
+/* Proxy worker copies one direction until EOF, framing/unframing in compressed mode */
+static unsigned __stdcall proxy_worker(void *arg) {
+    ProxyArgs pa = *(ProxyArgs*)arg;
+    free(arg);
+    ZSession *s = pa.sess;
+    if (s->compress) {
+        if (pa.dir == 0) compress_loop(s);
+        else decompress_loop(s);
+    } else {
+        SOCKET from = pa.dir == 0 ? s->plain : s->link;
+        SOCKET to = pa.dir == 0 ? s->link : s->plain;
+        unsigned char buf[BUF_SZ];
+        while (1) {
+            int r = recv(from, (char*)buf, (int)sizeof(buf), 0);
+            if (r <= 0) break;
+            if (!send_all(to, buf, r)) break;
+        }
+    }
+    /* wake up the other direction, last one out cleans up */
+    shutdown(s->plain, SD_BOTH);
+    shutdown(s->link, SD_BOTH);
+    if (InterlockedDecrement(&s->workers) == 0) {
+        if (s->compress) {
+            ZStats z = s->dir[0];
+            zstats_add(&z, &s->dir[1]);
+            char zs[320];
+            format_zstats(zs, sizeof(zs), &z);
+            debug_printf("Session %d (port %d) closed: %s", s->sessionid, s->port, zs);
+        }
+        closesocket(s->plain);
+        closesocket(s->link);
+        free(s);
+    }
+    return 0;
+}
+
+/* Start both directions between the plain socket and the DATA link */
+static void start_proxy_pair(SOCKET plain, SOCKET link, int compress, int sessionid, int port) {
+    ZSession *s = (ZSession*)calloc(1, sizeof(ZSession));
+    ProxyArgs *p1 = (ProxyArgs*)malloc(sizeof(ProxyArgs));
+    ProxyArgs *p2 = (ProxyArgs*)malloc(sizeof(ProxyArgs));
+    if (!s || !p1 || !p2) { free(s); free(p1); free(p2); closesocket(plain); closesocket(link); return; }
+    s->plain = plain;
+    s->link = link;
+    s->compress = compress;
+    s->sessionid = sessionid;
+    s->port = port;
+    s->workers = 2;
+    p1->sess = s; p1->dir = 0;
+    p2->sess = s; p2->dir = 1;
+    _beginthreadex(NULL, 0, proxy_worker, p1, 0, NULL);
+    _beginthreadex(NULL, 0, proxy_worker, p2, 0, NULL);
+}
+
+#endif /* ZLINK_H */